@@ -9,18 +9,34 @@ defmodule RpiFbCapture do
           {:width, non_neg_integer()}
           | {:height, non_neg_integer()}
           | {:display, non_neg_integer()}
-  @type format :: :ppm | :rgb24 | :rgb565 | :mono | :mono_column_scan
+          | {:metadata, boolean()}
+          | {:transport, :port | :nif}
+  @type format ::
+          :ppm
+          | :rgb24
+          | :rgb565
+          | :rgb565_half
+          | :mono
+          | :mono_column_scan
+          | :indexed8
+          | :indexed4
+          | :adaptive
+  @type palette :: :fixed | :adaptive | [{byte(), byte(), byte()}]
   @type dithering :: :none | :floyd_steinberg | :sierra | :sierra_2row | :sierra_lite
 
+  alias RpiFbCapture.Nif
+
   defmodule State do
     @moduledoc false
     defstruct port: nil,
+              nif: nil,
               width: 0,
               height: 0,
               display_width: 0,
               display_height: 0,
               display_id: 0,
               backend_name: "unknown",
+              metadata: false,
               request: nil
   end
 
@@ -36,6 +52,11 @@ defmodule RpiFbCapture do
   * `:width` - the width of the capture window (0 for the display width)
   * `:height` - the height of the capture window (0 for the display width)
   * `:display` - which display to capture (defaults to 0)
+  * `:metadata` - set to `true` to fill in the sequence number, timestamp and
+    timing fields of `RpiFbCapture.Capture` (defaults to `false`)
+  * `:transport` - `:port` to capture in a separate OS process (the default) or
+    `:nif` to capture in the BEAM on a dirty scheduler. The NIF avoids copying
+    frames through a pipe, but a crash in it takes down the VM.
   """
   @spec start_link([option()]) :: :ignore | {:error, any()} | {:ok, pid()}
   def start_link(args \\ []) when is_list(args) do
@@ -58,8 +79,18 @@ defmodule RpiFbCapture do
   * `:ppm` - PPM-formatted data
   * `:rgb24` - Raw 24-bit RGB data 8-bits R, G, then B
   * `:rgb565` - Raw 16-bit data 5-bits R, 6-bits G, 5-bits B
+  * `:rgb565_half` - Like `:rgb565`, but half the width and height. Each pixel
+    is the average of a 2x2 block.
   * `:mono` - Raw 1-bpp data
   * `:mono_column_scan` - Raw 1-bpp data, but scanned down columns
+  * `:indexed8` - 8-bit palette indices. The capture's `:palette` has the 256
+    colors. See `set_palette/3`.
+  * `:indexed4` - 4-bit palette indices, two pixels per byte with the first
+    pixel in the low nibble. The capture's `:palette` has the 16 colors.
+  * `:adaptive` - Pick the best of `:rgb565`, `:rgb565_half`, `:mono` with
+    Sierra dithering and `:mono` without dithering that meets the targets set
+    by `set_adaptive_target/2`. The returned capture's `:format` and `:quality`
+    say what was picked. Only supported by the port transport.
   """
   @spec capture(GenServer.server(), format()) ::
           {:ok, RpiFbCapture.Capture.t()} | {:error, atom()}
@@ -72,12 +103,16 @@ defmodule RpiFbCapture do
 
   The threshold should be 8-bits. The capture buffer is rgb565, so the
   threshold will be reduced to 5 or 6 bits for the actual comparisons.
+  Other values return `{:error, :invalid_threshold}`.
   """
   @spec set_mono_threshold(GenServer.server(), byte()) :: :ok | {:error, atom()}
-  def set_mono_threshold(server, threshold) do
+  def set_mono_threshold(server, threshold)
+      when is_integer(threshold) and threshold >= 0 and threshold <= 255 do
     GenServer.call(server, {:mono_threshold, threshold})
   end
 
+  def set_mono_threshold(_server, _threshold), do: {:error, :invalid_threshold}
+
   @doc """
   Set dithering algorithm.
 
@@ -94,6 +129,81 @@ defmodule RpiFbCapture do
     GenServer.call(server, {:dithering, algorithm})
   end
 
+  @doc """
+  Set the palette for `:indexed8` and `:indexed4` captures.
+
+  Palettes include:
+
+  * `:fixed` - The 216 web-safe colors for `:indexed8` and the 16 VGA colors
+    for `:indexed4`. This is the default.
+  * `:adaptive` - Pick the most used colors in each frame
+  * A list of up to 256 `{r, g, b}` colors. `:indexed4` captures use the
+    first 16.
+
+  Options:
+
+  * `:dithering` - `:none` (the default) or `:ordered` for 4x4 Bayer dithering
+
+  Anything else returns `{:error, :invalid_palette}`.
+
+  Setting a `:fixed` palette or a color list rebuilds lookup tables, which
+  can take tens of milliseconds for large lists and longer on a Pi. The
+  port transport doesn't process other commands or send frames while this
+  happens, and the NIF transport runs it on a dirty scheduler. Avoid doing
+  it between every capture.
+  """
+  @spec set_palette(GenServer.server(), palette(), keyword()) :: :ok | {:error, atom()}
+  def set_palette(server, palette, opts \\ []) do
+    dithering = Keyword.get(opts, :dithering, :none)
+
+    if valid_palette?(palette) and dithering in [:none, :ordered] do
+      GenServer.call(server, {:palette, {palette, dithering}})
+    else
+      {:error, :invalid_palette}
+    end
+  end
+
+  defp valid_palette?(palette) when palette in [:fixed, :adaptive], do: true
+
+  defp valid_palette?(colors) when is_list(colors) and colors != [] do
+    length(colors) <= 256 and Enum.all?(colors, &valid_color?/1)
+  end
+
+  defp valid_palette?(_palette), do: false
+
+  defp valid_color?({r, g, b}), do: valid_byte?(r) and valid_byte?(g) and valid_byte?(b)
+  defp valid_color?(_color), do: false
+
+  defp valid_byte?(value), do: is_integer(value) and value >= 0 and value <= 255
+
+  @doc """
+  Set the targets for `:adaptive` captures.
+
+  The capture process measures how long it takes to capture and convert each
+  quality level and how fast frames are being read. It then picks the best
+  quality level that's expected to stay within the targets.
+
+  Options:
+
+  * `:fps` - the frame rate to sustain (0 for no limit, up to 65535)
+  * `:bytes_per_second` - the bandwidth budget (0 for no limit, up to 32-bits)
+
+  Other values return `{:error, :invalid_target}`.
+  """
+  @spec set_adaptive_target(GenServer.server(), keyword()) :: :ok | {:error, atom()}
+  def set_adaptive_target(server, opts) do
+    fps = Keyword.get(opts, :fps, 0)
+    bytes_per_second = Keyword.get(opts, :bytes_per_second, 0)
+
+    if valid_target?(fps, 0xFFFF) and valid_target?(bytes_per_second, 0xFFFFFFFF) do
+      GenServer.call(server, {:adaptive_target, {fps, bytes_per_second}})
+    else
+      {:error, :invalid_target}
+    end
+  end
+
+  defp valid_target?(value, max), do: is_integer(value) and value >= 0 and value <= max
+
   @doc """
   Helper method for saving a screen capture to a file
 
@@ -130,22 +240,15 @@ defmodule RpiFbCapture do
 
   @impl true
   def init(args) do
-    executable = Application.app_dir(:rpi_fb_capture, ["priv", "rpi_fb_capture"])
-    width = Keyword.get(args, :width, 0)
-    height = Keyword.get(args, :height, 0)
-    display = Keyword.get(args, :display, 0)
-
-    port =
-      Port.open({:spawn_executable, to_charlist(executable)}, [
-        {:args, [to_string(display), to_string(width), to_string(height)]},
-        {:packet, 4},
-        :use_stdio,
-        :binary,
-        :exit_status
-      ])
+    case Keyword.get(args, :transport, :port) do
+      :port -> init_port(args)
+      :nif -> init_nif(args)
+    end
+  end
 
-    state = %State{port: port, width: width, height: height}
-    {:ok, state}
+  @impl true
+  def handle_call({:capture, format}, _from, %{nif: nif} = state) when nif != nil do
+    {:reply, nif_capture(state, format), state}
   end
 
   @impl true
@@ -162,8 +265,7 @@ defmodule RpiFbCapture do
 
   @impl true
   def handle_call({:mono_threshold, threshold}, _from, state) do
-    Port.command(state.port, port_cmd(:mono_threshold, threshold))
-    {:reply, :ok, state}
+    {:reply, set_option(state, :mono_threshold, threshold), state}
   end
 
   @impl true
@@ -173,10 +275,27 @@ defmodule RpiFbCapture do
 
   @impl true
   def handle_call({:dithering, algorithm}, _from, state) do
-    Port.command(state.port, port_cmd(:dithering, algorithm))
-    {:reply, :ok, state}
+    {:reply, set_option(state, :dithering, algorithm), state}
+  end
+
+  @impl true
+  def handle_call({:palette, palette}, _from, state) do
+    {:reply, set_option(state, :palette, palette_args(palette)), state}
+  end
+
+  @impl true
+  def handle_call({:adaptive_target, target}, _from, state) do
+    {:reply, set_option(state, :adaptive_target, target), state}
+  end
+
+  @impl true
+  def terminate(_reason, %{nif: nif}) when nif != nil do
+    Nif.close(nif)
   end
 
+  @impl true
+  def terminate(_reason, _state), do: :ok
+
   @impl true
   def handle_info({port, {:data, data}}, %{port: port} = state) do
     handle_port(state, data)
@@ -192,6 +311,123 @@ defmodule RpiFbCapture do
     {:stop, :port_crashed}
   end
 
+  @impl true
+  def handle_info({:EXIT, _pid, reason}, state) do
+    # Only the NIF transport traps exits
+    {:stop, reason, state}
+  end
+
+  defp init_port(args) do
+    executable = Application.app_dir(:rpi_fb_capture, ["priv", "rpi_fb_capture"])
+    width = Keyword.get(args, :width, 0)
+    height = Keyword.get(args, :height, 0)
+    display = Keyword.get(args, :display, 0)
+    metadata = Keyword.get(args, :metadata, false)
+
+    port =
+      Port.open({:spawn_executable, to_charlist(executable)}, [
+        {:args, [to_string(display), to_string(width), to_string(height)]},
+        {:packet, 4},
+        :use_stdio,
+        :binary,
+        :exit_status
+      ])
+
+    if metadata do
+      Port.command(port, port_cmd(:metadata, true))
+    end
+
+    state = %State{port: port, width: width, height: height, metadata: metadata}
+    {:ok, state}
+  end
+
+  defp init_nif(args) do
+    width = Keyword.get(args, :width, 0)
+    height = Keyword.get(args, :height, 0)
+    display = Keyword.get(args, :display, 0)
+    metadata = Keyword.get(args, :metadata, false)
+
+    # Trap exits so that terminate/2 runs and the display is released before
+    # a supervisor tries to start a new capture.
+    Process.flag(:trap_exit, true)
+
+    case Nif.open(display, width, height) do
+      {:ok, nif} ->
+        {backend_name, display_id, display_width, display_height, capture_width, capture_height} =
+          Nif.info(nif)
+
+        state = %State{
+          nif: nif,
+          width: capture_width,
+          height: capture_height,
+          display_width: display_width,
+          display_height: display_height,
+          display_id: display_id,
+          backend_name: backend_name,
+          metadata: metadata
+        }
+
+        {:ok, state}
+
+      {:error, reason} ->
+        {:stop, reason}
+    end
+  end
+
+  defp nif_capture(state, format) do
+    case Nif.capture(state.nif, format_code(format)) do
+      {:ok, data, sequence, timestamp, convert_time, dither_time} ->
+        {width, height} = output_dimensions(state, format)
+        {palette, data} = split_palette(format, data)
+
+        result = %RpiFbCapture.Capture{
+          data: process_response(state, format, data),
+          width: width,
+          height: height,
+          format: format,
+          palette: palette
+        }
+
+        if state.metadata do
+          {:ok,
+           %{
+             result
+             | sequence: sequence,
+               timestamp: timestamp,
+               convert_time: convert_time,
+               dither_time: dither_time,
+               roi: {0, 0, state.width, state.height}
+           }}
+        else
+          {:ok, result}
+        end
+
+      error ->
+        error
+    end
+  end
+
+  defp set_option(%{nif: nil} = state, option, value) do
+    Port.command(state.port, port_cmd(option, value))
+    :ok
+  end
+
+  defp set_option(state, :mono_threshold, threshold) do
+    Nif.set_mono_threshold(state.nif, threshold)
+  end
+
+  defp set_option(state, :dithering, algorithm) do
+    Nif.set_dithering(state.nif, dithering_code(algorithm))
+  end
+
+  defp set_option(state, :palette, {kind, dithering, colors}) do
+    Nif.set_palette(state.nif, kind, dithering, colors)
+  end
+
+  defp set_option(_state, :adaptive_target, _target) do
+    {:error, :not_supported}
+  end
+
   defp handle_port(
          state,
          <<backend_name::16-bytes, display_id::native-32, display_width::native-32,
@@ -212,14 +448,45 @@ defmodule RpiFbCapture do
     {:noreply, new_state}
   end
 
+  defp handle_port(
+         %{request: {from, format}, metadata: metadata} = state,
+         <<sequence::native-32, format_code::native-32, timestamp::native-64,
+           convert_time::native-32, dither_time::native-32, roi_x::native-32, roi_y::native-32,
+           roi_width::native-32, roi_height::native-32, width::native-32, height::native-32,
+           quality::native-32, data::binary>>
+       )
+       when metadata or format == :adaptive do
+    {palette, data} = split_palette(format, data)
+
+    result = %RpiFbCapture.Capture{
+      data: process_response(%{state | width: width, height: height}, format, data),
+      width: width,
+      height: height,
+      format: if(format == :adaptive, do: format_from_code(format_code), else: format),
+      palette: palette,
+      sequence: sequence,
+      timestamp: timestamp,
+      convert_time: convert_time,
+      dither_time: dither_time,
+      roi: {roi_x, roi_y, roi_width, roi_height},
+      quality: if(format == :adaptive, do: quality)
+    }
+
+    GenServer.reply(from, {:ok, result})
+    {:noreply, %{state | request: nil}}
+  end
+
   defp handle_port(%{request: {from, format}} = state, data) do
+    {palette, data} = split_palette(format, data)
     result_data = process_response(state, format, data)
+    {width, height} = output_dimensions(state, format)
 
     result = %RpiFbCapture.Capture{
       data: result_data,
-      width: state.width,
-      height: state.height,
-      format: format
+      width: width,
+      height: height,
+      format: format,
+      palette: palette
     }
 
     GenServer.reply(from, {:ok, result})
@@ -236,17 +503,57 @@ defmodule RpiFbCapture do
     %{state | request: {from, format}}
   end
 
-  defp port_cmd(:capture, :ppm), do: <<2>>
-  defp port_cmd(:capture, :rgb24), do: <<2>>
-  defp port_cmd(:capture, :rgb565), do: <<3>>
-  defp port_cmd(:capture, :mono), do: <<4>>
-  defp port_cmd(:capture, :mono_column_scan), do: <<5>>
+  defp port_cmd(:capture, format), do: <<format_code(format)>>
   defp port_cmd(:mono_threshold, value), do: <<6, value>>
-  defp port_cmd(:dithering, :none), do: <<7, 0>>
-  defp port_cmd(:dithering, :floyd_steinberg), do: <<7, 1>>
-  defp port_cmd(:dithering, :sierra), do: <<7, 2>>
-  defp port_cmd(:dithering, :sierra_2row), do: <<7, 3>>
-  defp port_cmd(:dithering, :sierra_lite), do: <<7, 4>>
+  defp port_cmd(:dithering, algorithm), do: <<7, dithering_code(algorithm)>>
+  defp port_cmd(:metadata, false), do: <<8, 0>>
+  defp port_cmd(:metadata, true), do: <<8, 1>>
+
+  defp port_cmd(:palette, {kind, dithering, colors}), do: <<14, kind, dithering, colors::binary>>
+
+  defp port_cmd(:adaptive_target, {fps, bytes_per_second}),
+    do: <<11, fps::16, bytes_per_second::32>>
+
+  defp format_code(:ppm), do: 2
+  defp format_code(:rgb24), do: 2
+  defp format_code(:rgb565), do: 3
+  defp format_code(:mono), do: 4
+  defp format_code(:mono_column_scan), do: 5
+  defp format_code(:rgb565_half), do: 9
+  defp format_code(:adaptive), do: 10
+  defp format_code(:indexed8), do: 12
+  defp format_code(:indexed4), do: 13
+
+  defp format_from_code(3), do: :rgb565
+  defp format_from_code(4), do: :mono
+  defp format_from_code(9), do: :rgb565_half
+
+  defp palette_args({palette, dithering}) do
+    {kind, colors} =
+      case palette do
+        :fixed -> {0, <<>>}
+        :adaptive -> {2, <<>>}
+        colors when is_list(colors) -> {1, for({r, g, b} <- colors, into: <<>>, do: <<r, g, b>>)}
+      end
+
+    {kind, palette_dithering_code(dithering), colors}
+  end
+
+  defp palette_dithering_code(:none), do: 0
+  defp palette_dithering_code(:ordered), do: 1
+
+  defp split_palette(:indexed8, <<palette::binary-size(768), data::binary>>), do: {palette, data}
+  defp split_palette(:indexed4, <<palette::binary-size(48), data::binary>>), do: {palette, data}
+  defp split_palette(_format, data), do: {nil, data}
+
+  defp output_dimensions(state, :rgb565_half), do: {div(state.width, 2), div(state.height, 2)}
+  defp output_dimensions(state, _format), do: {state.width, state.height}
+
+  defp dithering_code(:none), do: 0
+  defp dithering_code(:floyd_steinberg), do: 1
+  defp dithering_code(:sierra), do: 2
+  defp dithering_code(:sierra_2row), do: 3
+  defp dithering_code(:sierra_lite), do: 4
 
   defp process_response(state, :ppm, data) do
     ["P6 #{state.width} #{state.height} 255\n", data]
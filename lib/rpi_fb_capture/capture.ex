@@ -1,16 +1,48 @@
 defmodule RpiFbCapture.Capture do
   @moduledoc """
   Capture data and metadata for one frame.
+
+  For `:indexed8` and `:indexed4` captures, `:palette` holds the frame's
+  colors as consecutive 8-bit red, green and blue values. It's `nil` for
+  other formats.
+
+  The `:sequence`, `:timestamp`, `:convert_time`, `:dither_time` and `:roi`
+  fields are only filled in when the capture process was started with
+  `metadata: true`. Otherwise they're `nil`.
+
+  * `:sequence` - frame counter. Gaps mean that frames were dropped.
+  * `:timestamp` - `CLOCK_MONOTONIC` time in nanoseconds taken right after the
+    capture. This is not the same clock as `System.monotonic_time/0`.
+  * `:convert_time` - nanoseconds spent converting to the requested format
+  * `:dither_time` - nanoseconds spent dithering
+  * `:roi` - the captured region of the display as `{x, y, width, height}`
+
+  `:adaptive` captures always have these fields and also set `:quality` to
+  the level that was picked. 0 is the best quality and 3 is the cheapest.
   """
   defstruct data: [],
             width: 0,
             height: 0,
-            format: :rgb565
+            format: :rgb565,
+            palette: nil,
+            sequence: nil,
+            timestamp: nil,
+            convert_time: nil,
+            dither_time: nil,
+            roi: nil,
+            quality: nil
 
   @type t :: %__MODULE__{
           data: iodata(),
           width: non_neg_integer(),
           height: non_neg_integer(),
-          format: RpiFbCapture.format()
+          format: RpiFbCapture.format(),
+          palette: binary() | nil,
+          sequence: non_neg_integer() | nil,
+          timestamp: non_neg_integer() | nil,
+          convert_time: non_neg_integer() | nil,
+          dither_time: non_neg_integer() | nil,
+          roi: {non_neg_integer(), non_neg_integer(), non_neg_integer(), non_neg_integer()} | nil,
+          quality: non_neg_integer() | nil
         }
 end
@@ -0,0 +1,23 @@
+defmodule RpiFbCapture.Nif do
+  @moduledoc false
+
+  # In-process capture. See `src/nif.c`. Use `RpiFbCapture` with
+  # `transport: :nif` rather than calling these directly.
+
+  @on_load {:load_nif, 0}
+  @compile {:autoload, false}
+
+  def load_nif do
+    nif_binary = Application.app_dir(:rpi_fb_capture, ["priv", "rpi_fb_capture_nif"])
+
+    :erlang.load_nif(to_charlist(nif_binary), 0)
+  end
+
+  def open(_display, _width, _height), do: :erlang.nif_error(:nif_not_loaded)
+  def info(_ref), do: :erlang.nif_error(:nif_not_loaded)
+  def capture(_ref, _format), do: :erlang.nif_error(:nif_not_loaded)
+  def set_mono_threshold(_ref, _threshold), do: :erlang.nif_error(:nif_not_loaded)
+  def set_dithering(_ref, _dithering), do: :erlang.nif_error(:nif_not_loaded)
+  def set_palette(_ref, _kind, _dithering, _colors), do: :erlang.nif_error(:nif_not_loaded)
+  def close(_ref), do: :erlang.nif_error(:nif_not_loaded)
+end
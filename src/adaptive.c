@@ -0,0 +1,127 @@
+#include "adaptive.h"
+#include "capture.h"
+#include "dithering.h"
+#include "frame.h"
+
+// The adaptive controller picks the best quality level that it expects can
+// be captured, converted and drained by Erlang within the frame rate and
+// bandwidth targets. It drops as many levels as needed immediately, but
+// only steps back up one level at a time after a run of frames that had
+// headroom.
+
+// Frames that need to have headroom before trying the next better level
+#define STEP_UP_FRAMES              8
+
+// Percent of the budget that the next better level needs to fit in
+#define STEP_UP_HEADROOM            80
+
+static const struct {
+    int format;
+    int dithering;
+} levels[ADAPTIVE_LEVELS] = {
+    {FORMAT_RGB565, DITHERING_NONE},
+    {FORMAT_RGB565_HALF, DITHERING_NONE},
+    {FORMAT_MONO, DITHERING_SIERRA},
+    {FORMAT_MONO, DITHERING_NONE}
+};
+
+static uint64_t smooth(uint64_t average, uint64_t sample)
+{
+    return average == 0 ? sample : (3 * average + sample) / 4;
+}
+
+void adaptive_set_target(struct adaptive_controller *controller, uint32_t fps, uint32_t bytes_per_second)
+{
+    controller->target_fps = fps;
+    controller->target_bytes_per_second = bytes_per_second;
+    controller->level = 0;
+    controller->good_frames = 0;
+}
+
+int adaptive_format(int level)
+{
+    return levels[level].format;
+}
+
+int adaptive_dithering(int level)
+{
+    return levels[level].dithering;
+}
+
+static uint64_t estimate_ns(const struct adaptive_controller *controller, const struct capture_info *info, int level)
+{
+    // Levels that haven't been tried get the current level's processing time
+    uint64_t process_ns = controller->process_ns[level];
+    if (process_ns == 0)
+        process_ns = controller->process_ns[controller->level];
+
+    uint64_t drain_ns = 0;
+    if (controller->drain_bps > 0)
+        drain_ns = frame_size(info, levels[level].format) * 1000000000ULL / controller->drain_bps;
+
+    return process_ns + drain_ns;
+}
+
+// Return the percent of the tightest budget that a level is expected to use
+static uint64_t budget_used(const struct adaptive_controller *controller, const struct capture_info *info, int level)
+{
+    uint64_t used = 0;
+    uint64_t interval_ns = controller->request_interval_ns;
+
+    if (controller->target_fps > 0) {
+        interval_ns = 1000000000ULL / controller->target_fps;
+        used = estimate_ns(controller, info, level) * 100 / interval_ns;
+    }
+
+    if (controller->target_bytes_per_second > 0 && interval_ns > 0) {
+        uint64_t bytes_per_second = frame_size(info, levels[level].format) * 1000000000ULL / interval_ns;
+        uint64_t bandwidth_used = bytes_per_second * 100 / controller->target_bytes_per_second;
+        if (bandwidth_used > used)
+            used = bandwidth_used;
+    }
+    return used;
+}
+
+int adaptive_choose(struct adaptive_controller *controller, const struct capture_info *info, uint64_t request_ns)
+{
+    if (controller->last_request_ns)
+        controller->request_interval_ns = smooth(controller->request_interval_ns, request_ns - controller->last_request_ns);
+    controller->last_request_ns = request_ns;
+
+    int level = controller->level;
+    while (level < ADAPTIVE_LEVELS - 1 && budget_used(controller, info, level) > 100)
+        level++;
+
+    if (level == controller->level && level > 0 &&
+            budget_used(controller, info, level - 1) <= STEP_UP_HEADROOM) {
+        controller->good_frames++;
+        if (controller->good_frames >= STEP_UP_FRAMES) {
+            level--;
+            controller->good_frames = 0;
+        }
+    } else {
+        controller->good_frames = 0;
+    }
+
+    controller->level = level;
+    return level;
+}
+
+void adaptive_record(struct adaptive_controller *controller, int level, uint64_t process_ns)
+{
+    controller->process_ns[level] = smooth(controller->process_ns[level], process_ns);
+}
+
+// Only frames that backed up in the pipe say anything about how fast Erlang
+// reads. Frames that didn't mean that output isn't the limit right now, so
+// the next better level gets retried after a run of good frames.
+void adaptive_record_drain(struct adaptive_controller *controller, size_t len, uint64_t drain_ns)
+{
+    if (drain_ns == 0) {
+        controller->drain_bps = 0;
+        return;
+    }
+
+    uint64_t bps = len * 1000000000ULL / drain_ns;
+    controller->drain_bps = smooth(controller->drain_bps, bps);
+}
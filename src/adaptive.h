@@ -0,0 +1,38 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Quality levels from best to cheapest
+#define ADAPTIVE_LEVELS             4
+
+struct capture_info;
+
+struct adaptive_controller {
+    // Targets. 0 means no limit.
+    uint32_t target_fps;
+    uint32_t target_bytes_per_second;
+
+    int level;
+    int good_frames;
+
+    uint64_t last_request_ns;
+    uint64_t request_interval_ns;
+
+    // Smoothed rate that frames drain when the pipe backs up. 0 if frames
+    // aren't backing up.
+    uint64_t drain_bps;
+
+    // Smoothed capture + conversion time for each level. 0 if not measured yet.
+    uint64_t process_ns[ADAPTIVE_LEVELS];
+};
+
+void adaptive_set_target(struct adaptive_controller *controller, uint32_t fps, uint32_t bytes_per_second);
+int adaptive_choose(struct adaptive_controller *controller, const struct capture_info *info, uint64_t request_ns);
+void adaptive_record(struct adaptive_controller *controller, int level, uint64_t process_ns);
+void adaptive_record_drain(struct adaptive_controller *controller, size_t len, uint64_t drain_ns);
+int adaptive_format(int level);
+int adaptive_dithering(int level);
+
+#endif
@@ -3,7 +3,16 @@
 
 #include <stdint.h>
 
-#define MAX_REQUEST_BUFFER_SIZE     256
+#include "adaptive.h"
+#include "output.h"
+#include "palette.h"
+
+#define MAX_REQUEST_BUFFER_SIZE     1024
+
+// Optional per-frame header: sequence, format, timestamp (64-bit), convert and
+// dither durations, ROI x, y, width, height, output width and height, and the
+// adaptive quality level.
+#define FRAME_HEADER_LEN            52
 
 struct capture_info {
     char backend_name[16];
@@ -23,13 +32,27 @@ struct capture_info {
     uint16_t *buffer;
     uint8_t *work;
 
+    struct output_queue output;
+
     uint8_t request_buffer[MAX_REQUEST_BUFFER_SIZE];
     int request_buffer_ix;
 
     int send_snapshot;
+    uint64_t request_ns;
+
+    int frame_metadata;
+    uint32_t sequence;
+    uint64_t capture_timestamp;
+    uint64_t capture_ns;
+    uint64_t convert_start;
+    uint32_t dither_ns;
 
     int dithering;
     int16_t *dithering_buffer;
+
+    struct adaptive_controller adaptive;
+
+    struct palette_info palette;
 };
 
 int capture_initialize(uint32_t device, int width, int height, struct capture_info *info);
@@ -1,9 +1,12 @@
 #include "capture.h"
 
 #include <bcm_host.h>
+#include <stdatomic.h>
 #include <syslog.h>
 
-// Only one display is supported now.
+// Only one display is supported now. The NIF can try to open more than one,
+// so guard the handles.
+static atomic_flag display_in_use = ATOMIC_FLAG_INIT;
 static DISPMANX_DISPLAY_HANDLE_T display_handle;
 static DISPMANX_RESOURCE_HANDLE_T capture_resource;
 
@@ -11,6 +14,11 @@ int capture_initialize(uint32_t device, int width, int height, struct capture_in
 {
     strcpy(info->backend_name, "dispmanx");
 
+    if (atomic_flag_test_and_set(&display_in_use)) {
+        syslog(LOG_ERR, "Display capture already in use");
+        return -1;
+    }
+
     bcm_host_init();
 
     info->request_buffer_ix = 0;
@@ -18,12 +26,15 @@ int capture_initialize(uint32_t device, int width, int height, struct capture_in
     display_handle = vc_dispmanx_display_open(device);
     if (!display_handle) {
         syslog(LOG_ERR, "Unable to open primary display");
+        atomic_flag_clear(&display_in_use);
         return -1;
     }
     DISPMANX_MODEINFO_T display_info;
     int ret = vc_dispmanx_display_get_info(display_handle, &display_info);
     if (ret) {
         syslog(LOG_ERR, "Unable to get primary display information");
+        vc_dispmanx_display_close(display_handle);
+        atomic_flag_clear(&display_in_use);
         return -1;
     }
 
@@ -49,15 +60,18 @@ int capture_initialize(uint32_t device, int width, int height, struct capture_in
     if (!capture_resource) {
         syslog(LOG_ERR, "Unable to create screen buffer");
         vc_dispmanx_display_close(display_handle);
+        atomic_flag_clear(&display_in_use);
         return -1;
     }
 
+    return 0;
 }
 
 void capture_finalize()
 {
     vc_dispmanx_resource_delete(capture_resource);
     vc_dispmanx_display_close(display_handle);
+    atomic_flag_clear(&display_in_use);
 }
 
 int capture(struct capture_info *info)
@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "dithering.h"
+#include "frame.h"
+
+// Conversions from the captured rgb565 buffer. These are shared by the port
+// process and the NIF.
+
+uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void frame_set_mono_threshold(struct capture_info *info, uint8_t threshold)
+{
+    // Convert the 8-bit threshold to the number of bits for rgb565 comparisons
+    // and pre-shift.
+    info->mono_threshold_r5 = threshold >> 3;
+    info->mono_threshold_g6 = (threshold >> 2) << 5;
+    info->mono_threshold_b5 = (threshold >> 3) << 11;
+}
+
+void frame_set_dithering(struct capture_info *info, uint8_t value)
+{
+    info->dithering = value;
+}
+
+int frame_initialize(uint32_t device, int width, int height, struct capture_info *info)
+{
+    memset(info, 0, sizeof(*info));
+
+    if (capture_initialize(device, width, height, info) < 0)
+        return -1;
+
+    // This is an arbitrary value that looks relatively good for a program that wasn't
+    // designed for monochrome.
+    frame_set_mono_threshold(info, 25);
+
+    info->buffer = (uint16_t *) malloc(info->capture_stride * info->capture_height * sizeof(uint16_t));
+    info->dithering_buffer = (int16_t *) malloc(info->capture_width * info->capture_height * sizeof(int16_t));
+
+    // Clean up everything on failure since the NIF keeps running afterwards
+    // and the backend may only allow one capture at a time.
+    if (!info->buffer || !info->dithering_buffer || palette_initialize(&info->palette) < 0) {
+        frame_finalize(info);
+        return -1;
+    }
+
+    return 0;
+}
+
+void frame_finalize(struct capture_info *info)
+{
+    free(info->buffer);
+    free(info->dithering_buffer);
+    palette_finalize(&info->palette);
+
+    capture_finalize(info);
+}
+
+static void timed_dithering_apply(struct capture_info *info)
+{
+    uint64_t dither_start = monotonic_ns();
+    dithering_apply(info);
+    info->dither_ns = monotonic_ns() - dither_start;
+}
+
+static uint8_t *convert_rgb24(struct capture_info *info, uint8_t *out)
+{
+    int width = info->capture_width;
+    int height = info->capture_height;
+    const uint16_t *image = info->buffer;
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint16_t pixel = image[x];
+            out[0] = (pixel >> 11) << 3;
+            out[1] = ((pixel >> 5) & 0x3f) << 2;
+            out[2] = (pixel & 0x1f) << 3;
+            out += 3;
+        }
+        image += info->capture_stride;
+    }
+    return out;
+}
+
+static uint8_t *convert_rgb565(struct capture_info *info, uint8_t *out)
+{
+    int width = info->capture_width;
+    int height = info->capture_height;
+    const uint16_t *image = info->buffer;
+
+    int width_bytes = width * sizeof(uint16_t);
+    for (int y = 0; y < height; y++) {
+        memcpy(out, image, width_bytes);
+        out += width_bytes;
+        image += info->capture_stride;
+    }
+    return out;
+}
+
+static inline uint16_t average_rgb565(uint16_t a, uint16_t b, uint16_t c, uint16_t d)
+{
+    uint16_t r = ((a >> 11) + (b >> 11) + (c >> 11) + (d >> 11)) >> 2;
+    uint16_t g = (((a >> 5) & 0x3f) + ((b >> 5) & 0x3f) + ((c >> 5) & 0x3f) + ((d >> 5) & 0x3f)) >> 2;
+    uint16_t bl = ((a & 0x1f) + (b & 0x1f) + (c & 0x1f) + (d & 0x1f)) >> 2;
+
+    return (r << 11) | (g << 5) | bl;
+}
+
+static uint8_t *convert_rgb565_half(struct capture_info *info, uint8_t *out)
+{
+    int width = info->capture_width / 2;
+    int height = info->capture_height / 2;
+    int stride = info->capture_stride;
+    const uint16_t *image = info->buffer;
+
+    // Each output pixel is the average of a 2x2 block
+    for (int y = 0; y < height; y++) {
+        const uint16_t *row0 = image;
+        const uint16_t *row1 = image + stride;
+        for (int x = 0; x < width; x++) {
+            uint16_t pixel = average_rgb565(row0[0], row0[1], row1[0], row1[1]);
+            memcpy(out, &pixel, sizeof(uint16_t));
+            out += sizeof(uint16_t);
+            row0 += 2;
+            row1 += 2;
+        }
+        image += 2 * stride;
+    }
+    return out;
+}
+
+static inline int to_1bpp(const struct capture_info *info, uint16_t rgb565)
+{
+    if ((rgb565 & 0x001f) > info->mono_threshold_r5 ||
+            (rgb565 & 0x07e0) > info->mono_threshold_g6 ||
+            (rgb565 & 0xf800) > info->mono_threshold_b5)
+        return 1;
+    else
+        return 0;
+}
+
+static uint8_t *convert_mono(struct capture_info *info, uint8_t *out)
+{
+    int width = info->capture_width;
+    int height = info->capture_height;
+    const uint16_t *image = info->buffer;
+    const int16_t * buffer = info->dithering_buffer;
+    size_t row_skip = info->capture_stride - info->capture_width;
+
+    if (info->dithering == DITHERING_NONE) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x += 8) {
+                *out = to_1bpp(info, image[0])
+                       | (to_1bpp(info, image[1]) << 1)
+                       | (to_1bpp(info, image[2]) << 2)
+                       | (to_1bpp(info, image[3]) << 3)
+                       | (to_1bpp(info, image[4]) << 4)
+                       | (to_1bpp(info, image[5]) << 5)
+                       | (to_1bpp(info, image[6]) << 6)
+                       | (to_1bpp(info, image[7]) << 7);
+                image += 8;
+                out++;
+            }
+            image += row_skip;
+        }
+    } else {
+        timed_dithering_apply(info);
+
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x += 8) {
+                *out = (buffer[0] != 0 ? 1 : 0)
+                       |  ((buffer[1] != 0 ? 1 : 0) << 1)
+                       |  ((buffer[2] != 0 ? 1 : 0) << 2)
+                       |  ((buffer[3] != 0 ? 1 : 0) << 3)
+                       |  ((buffer[4] != 0 ? 1 : 0) << 4)
+                       |  ((buffer[5] != 0 ? 1 : 0) << 5)
+                       |  ((buffer[6] != 0 ? 1 : 0) << 6)
+                       |  ((buffer[7] != 0 ? 1 : 0) << 7);
+
+                buffer += 8;
+                out++;
+            }
+        }
+    }
+    return out;
+}
+
+static uint8_t *convert_mono_rotate_flip(struct capture_info *info, uint8_t *out)
+{
+    int width = info->capture_width;
+    int height = info->capture_height;
+    int stride = info->capture_stride;
+    const uint16_t *image = info->buffer;
+    const int16_t * dithering_buffer = info->dithering_buffer;
+
+    if (info->dithering == DITHERING_NONE) {
+        for (int x = 0; x < width; x++) {
+            const uint16_t *column = image;
+            for (int y = 0; y < height; y += 8) {
+                *out = to_1bpp(info, column[0])
+                       | (to_1bpp(info, column[stride]) << 1)
+                       | (to_1bpp(info, column[2 * stride]) << 2)
+                       | (to_1bpp(info, column[3 * stride]) << 3)
+                       | (to_1bpp(info, column[4 * stride]) << 4)
+                       | (to_1bpp(info, column[5 * stride]) << 5)
+                       | (to_1bpp(info, column[6 * stride]) << 6)
+                       | (to_1bpp(info, column[7 * stride]) << 7);
+                column += 8 * stride;
+                out++;
+            }
+            image++;
+        }
+    } else {
+        timed_dithering_apply(info);
+
+        for (uint16_t x = 0; x < width; x++) {
+            const uint16_t *column = dithering_buffer;
+            for (uint16_t y = 0; y < height; y += 8) {
+                *out = ((column[0] != 0 ? 1 : 0))
+                       |  ((column[width] != 0 ? 1 : 0) << 1)
+                       |  ((column[width * 2] != 0 ? 1 : 0) << 2)
+                       |  ((column[width * 3] != 0 ? 1 : 0) << 3)
+                       |  ((column[width * 4] != 0 ? 1 : 0) << 4)
+                       |  ((column[width * 5] != 0 ? 1 : 0) << 5)
+                       |  ((column[width * 6] != 0 ? 1 : 0) << 6)
+                       |  ((column[width * 7] != 0 ? 1 : 0) << 7);
+
+                column += 8 * width;
+                out++;
+            }
+            dithering_buffer++;
+        }
+    }
+    return out;
+}
+
+size_t frame_size(const struct capture_info *info, int format)
+{
+    size_t pixels = info->capture_width * info->capture_height;
+
+    switch (format) {
+    case 1:
+    case FORMAT_RGB24:
+        return 3 * pixels;
+    case FORMAT_RGB565:
+        return sizeof(uint16_t) * pixels;
+    case FORMAT_RGB565_HALF:
+        return sizeof(uint16_t) * (info->capture_width / 2) * (info->capture_height / 2);
+    case FORMAT_MONO:
+    case FORMAT_MONO_COLUMN_SCAN:
+        return pixels / 8;
+    case FORMAT_INDEXED8:
+        return 256 * 3 + pixels;
+    case FORMAT_INDEXED4:
+        return 16 * 3 + (pixels + 1) / 2;
+    default:
+        return 0;
+    }
+}
+
+void frame_dimensions(const struct capture_info *info, int format, int *width, int *height)
+{
+    if (format == FORMAT_RGB565_HALF) {
+        *width = info->capture_width / 2;
+        *height = info->capture_height / 2;
+    } else {
+        *width = info->capture_width;
+        *height = info->capture_height;
+    }
+}
+
+uint8_t *frame_convert(struct capture_info *info, int format, uint8_t *out)
+{
+    info->dither_ns = 0;
+
+    switch (format) {
+    case 1:
+    case FORMAT_RGB24:
+        return convert_rgb24(info, out);
+    case FORMAT_RGB565:
+        return convert_rgb565(info, out);
+    case FORMAT_RGB565_HALF:
+        return convert_rgb565_half(info, out);
+    case FORMAT_MONO:
+        return convert_mono(info, out);
+    case FORMAT_MONO_COLUMN_SCAN:
+        return convert_mono_rotate_flip(info, out);
+    case FORMAT_INDEXED8:
+        return palette_convert(info, 8, out);
+    case FORMAT_INDEXED4:
+        return palette_convert(info, 4, out);
+    default:
+        return out;
+    }
+}
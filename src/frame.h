@@ -0,0 +1,31 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "capture.h"
+
+// Capture formats. These are the same as the port's capture command numbers.
+#define FORMAT_RGB24                2
+#define FORMAT_RGB565               3
+#define FORMAT_MONO                 4
+#define FORMAT_MONO_COLUMN_SCAN     5
+#define FORMAT_RGB565_HALF          9
+#define FORMAT_INDEXED8             12
+#define FORMAT_INDEXED4             13
+
+// Port only: let the adaptive controller pick one of the above
+#define FORMAT_ADAPTIVE             10
+
+uint64_t monotonic_ns();
+
+int frame_initialize(uint32_t device, int width, int height, struct capture_info *info);
+void frame_finalize(struct capture_info *info);
+void frame_set_mono_threshold(struct capture_info *info, uint8_t threshold);
+void frame_set_dithering(struct capture_info *info, uint8_t value);
+size_t frame_size(const struct capture_info *info, int format);
+void frame_dimensions(const struct capture_info *info, int format, int *width, int *height);
+uint8_t *frame_convert(struct capture_info *info, int format, uint8_t *out);
+
+#endif
@@ -6,37 +6,32 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "adaptive.h"
 #include "capture.h"
-#include "dithering.h"
+#include "frame.h"
+#include "output.h"
 
-static void set_mono_threshold(struct capture_info *info, uint8_t threshold)
+static void set_frame_metadata(struct capture_info *info, uint8_t value)
 {
-    // Convert the 8-bit threshold to the number of bits for rgb565 comparisons
-    // and pre-shift.
-    info->mono_threshold_r5 = threshold >> 3;
-    info->mono_threshold_g6 = (threshold >> 2) << 5;
-    info->mono_threshold_b5 = (threshold >> 3) << 11;
-}
-
-static void set_dithering(struct capture_info *info, uint8_t value)
-{
-    info->dithering = value;
+    info->frame_metadata = value;
 }
 
 static int initialize(uint32_t device, int width, int height, struct capture_info *info)
 {
-    memset(info, 0, sizeof(*info));
-
-    if (capture_initialize(device, width, height, info) < 0)
+    if (frame_initialize(device, width, height, info) < 0)
         return -1;
 
-    // This is an arbitrary value that looks relatively good for a program that wasn't
-    // designed for monochrome.
-    set_mono_threshold(info, 25);
+    // The work buffer holds one packet. RGB24 is the largest conversion except
+    // for tiny captures where the 8-bit palette can be bigger.
+    size_t rgb24_size = frame_size(info, FORMAT_RGB24);
+    size_t indexed8_size = frame_size(info, FORMAT_INDEXED8);
+    size_t work_size = 4 + FRAME_HEADER_LEN + (rgb24_size > indexed8_size ? rgb24_size : indexed8_size);
+    info->work = (uint8_t *) malloc(work_size);
+    if (!info->work)
+        return -1;
 
-    info->buffer = (uint16_t *) malloc(info->capture_stride * info->capture_height * sizeof(uint16_t));
-    info->work = (uint8_t *) malloc(info->capture_width * info->capture_height * 4);
-    info->dithering_buffer = (int16_t *) malloc(info->capture_width * info->capture_height * sizeof(int16_t));
+    if (output_initialize(&info->output, STDOUT_FILENO, work_size) < 0)
+        return -1;
 
     return 0;
 }
@@ -44,17 +39,16 @@ static int initialize(uint32_t device, int width, int height, struct capture_inf
 // NOTE: Resources *should* be cleaned up on process exit...
 static void finalize(struct capture_info *info)
 {
-    free(info->buffer);
     free(info->work);
-    free(info->dithering_buffer);
+    output_finalize(&info->output);
 
-    capture_finalize(info);
+    frame_finalize(info);
 }
 
-static void write_stdout(void *buffer, size_t len)
+static void write_stdout(struct capture_info *info, uint8_t *end)
 {
-    if (write(STDOUT_FILENO, buffer, len) != (ssize_t) len)
-        err(EXIT_FAILURE, "write");
+    if (output_enqueue(&info->output, &info->work, end - info->work) < 0)
+        errx(EXIT_FAILURE, "Output queue full");
 }
 
 static uint8_t *add_packet_length(uint8_t *out, uint32_t size)
@@ -66,157 +60,59 @@ static uint8_t *add_packet_length(uint8_t *out, uint32_t size)
     return out + 4;
 }
 
-static int emit_rgb24(const struct capture_info *info)
+static uint8_t *add_u32(uint8_t *out, uint32_t value)
 {
-    int width = info->capture_width;
-    int height = info->capture_height;
-    const uint16_t *image = info->buffer;
-
-    uint8_t *out = add_packet_length(info->work, 3 * width * height);
-
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            uint16_t pixel = image[x];
-            out[0] = (pixel >> 11) << 3;
-            out[1] = ((pixel >> 5) & 0x3f) << 2;
-            out[2] = (pixel & 0x1f) << 3;
-            out += 3;
-        }
-        image += info->capture_stride;
-    }
-    write_stdout(info->work, out - info->work);
-    return 0;
+    memcpy(out, &value, sizeof(uint32_t));
+    return out + sizeof(uint32_t);
 }
 
-static int emit_rgb565(const struct capture_info *info)
+static void set_adaptive_target(struct capture_info *info, const uint8_t *args)
 {
-    int width = info->capture_width;
-    int height = info->capture_height;
-    const uint16_t *image = info->buffer;
-
-    uint8_t *out = add_packet_length(info->work, sizeof(uint16_t) * width * height);
-
-    int width_bytes = width * sizeof(uint16_t);
-    for (int y = 0; y < height; y++) {
-        memcpy(out, image, width_bytes);
-        out += width_bytes;
-        image += info->capture_stride;
-    }
-    write_stdout(info->work, out - info->work);
-    return 0;
+    uint32_t fps = (args[0] << 8) | args[1];
+    uint32_t bytes_per_second = (args[2] << 24) | (args[3] << 16) | (args[4] << 8) | args[5];
+    adaptive_set_target(&info->adaptive, fps, bytes_per_second);
 }
 
-static inline int to_1bpp(const struct capture_info *info, uint16_t rgb565)
+static uint8_t *start_frame(struct capture_info *info, uint32_t size, int with_header)
 {
-    if ((rgb565 & 0x001f) > info->mono_threshold_r5 ||
-            (rgb565 & 0x07e0) > info->mono_threshold_g6 ||
-            (rgb565 & 0xf800) > info->mono_threshold_b5)
-        return 1;
-    else
-        return 0;
-}
+    info->convert_start = monotonic_ns();
 
-static int emit_mono(const struct capture_info *info)
-{
-    int width = info->capture_width;
-    int height = info->capture_height;
-    const uint16_t *image = info->buffer;
-    const int16_t * buffer = info->dithering_buffer;
-    size_t row_skip = info->capture_stride - info->capture_width;
-    uint8_t *out = add_packet_length(info->work, width * height / 8);
-
-    if (info->dithering == DITHERING_NONE) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x += 8) {
-                *out = to_1bpp(info, image[0])
-                       | (to_1bpp(info, image[1]) << 1)
-                       | (to_1bpp(info, image[2]) << 2)
-                       | (to_1bpp(info, image[3]) << 3)
-                       | (to_1bpp(info, image[4]) << 4)
-                       | (to_1bpp(info, image[5]) << 5)
-                       | (to_1bpp(info, image[6]) << 6)
-                       | (to_1bpp(info, image[7]) << 7);
-                image += 8;
-                out++;
-            }
-            image += row_skip;
-        }
-    } else {
-        dithering_apply(info);
-
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x += 8) {
-                *out = (buffer[0] != 0 ? 1 : 0)
-                       |  ((buffer[1] != 0 ? 1 : 0) << 1)
-                       |  ((buffer[2] != 0 ? 1 : 0) << 2)
-                       |  ((buffer[3] != 0 ? 1 : 0) << 3)
-                       |  ((buffer[4] != 0 ? 1 : 0) << 4)
-                       |  ((buffer[5] != 0 ? 1 : 0) << 5)
-                       |  ((buffer[6] != 0 ? 1 : 0) << 6)
-                       |  ((buffer[7] != 0 ? 1 : 0) << 7);
-
-                buffer += 8;
-                out++;
-            }
-        }
-    }
-    write_stdout(info->work, out - info->work);
-    return 0;
+    if (!with_header)
+        return add_packet_length(info->work, size);
+
+    // Leave room for the header. It's filled in once the conversion
+    // times are known.
+    return add_packet_length(info->work, FRAME_HEADER_LEN + size) + FRAME_HEADER_LEN;
 }
 
-static int emit_mono_rotate_flip(const struct capture_info *info)
+static void finish_frame(struct capture_info *info, int format, int quality, int with_header, uint8_t *end)
 {
-    int width = info->capture_width;
-    int height = info->capture_height;
-    int stride = info->capture_stride;
-    const uint16_t *image = info->buffer;
-    const int16_t * dithering_buffer = info->dithering_buffer;
-
-    uint8_t *out = add_packet_length(info->work, width * height / 8);
-
-    if (info->dithering == DITHERING_NONE) {
-        for (int x = 0; x < width; x++) {
-            const uint16_t *column = image;
-            for (int y = 0; y < height; y += 8) {
-                *out = to_1bpp(info, column[0])
-                       | (to_1bpp(info, column[stride]) << 1)
-                       | (to_1bpp(info, column[2 * stride]) << 2)
-                       | (to_1bpp(info, column[3 * stride]) << 3)
-                       | (to_1bpp(info, column[4 * stride]) << 4)
-                       | (to_1bpp(info, column[5 * stride]) << 5)
-                       | (to_1bpp(info, column[6 * stride]) << 6)
-                       | (to_1bpp(info, column[7 * stride]) << 7);
-                column += 8 * stride;
-                out++;
-            }
-            image++;
-        }
-    } else {
-        dithering_apply(info);
-
-        for (uint16_t x = 0; x < width; x++) {
-            const uint16_t *column = dithering_buffer;
-            for (uint16_t y = 0; y < height; y += 8) {
-                *out = ((column[0] != 0 ? 1 : 0))
-                       |  ((column[width] != 0 ? 1 : 0) << 1)
-                       |  ((column[width * 2] != 0 ? 1 : 0) << 2)
-                       |  ((column[width * 3] != 0 ? 1 : 0) << 3)
-                       |  ((column[width * 4] != 0 ? 1 : 0) << 4)
-                       |  ((column[width * 5] != 0 ? 1 : 0) << 5)
-                       |  ((column[width * 6] != 0 ? 1 : 0) << 6)
-                       |  ((column[width * 7] != 0 ? 1 : 0) << 7);
-
-                column += 8 * width;
-                out++;
-            }
-            dithering_buffer++;
-        }
+    if (with_header) {
+        uint32_t convert_ns = monotonic_ns() - info->convert_start - info->dither_ns;
+        int width;
+        int height;
+        frame_dimensions(info, format, &width, &height);
+
+        // See lib/rpi_fb_capture.ex for the decoder
+        uint8_t *out = info->work + 4;
+        out = add_u32(out, info->sequence);
+        out = add_u32(out, format);
+        memcpy(out, &info->capture_timestamp, sizeof(uint64_t));
+        out += sizeof(uint64_t);
+        out = add_u32(out, convert_ns);
+        out = add_u32(out, info->dither_ns);
+        out = add_u32(out, 0); // ROI x
+        out = add_u32(out, 0); // ROI y
+        out = add_u32(out, info->capture_width); // ROI width
+        out = add_u32(out, info->capture_height); // ROI height
+        out = add_u32(out, width);
+        out = add_u32(out, height);
+        add_u32(out, quality);
     }
-    write_stdout(info->work, out - info->work);
-    return 0;
+    write_stdout(info, end);
 }
 
-static int emit_capture_info(const struct capture_info *info)
+static int emit_capture_info(struct capture_info *info)
 {
     uint8_t *out = add_packet_length(info->work, 36);
     memcpy(out, &info->backend_name, 16);
@@ -231,7 +127,7 @@ static int emit_capture_info(const struct capture_info *info)
     out += sizeof(uint32_t);
     memcpy(out, &info->capture_height, sizeof(uint32_t));
     out += sizeof(uint32_t);
-    write_stdout(info->work, out - info->work);
+    write_stdout(info, out);
     return 0;
 }
 
@@ -250,7 +146,7 @@ static void handle_stdin(struct capture_info *info)
     while (info->request_buffer_ix >= 5) {
         // The request format is:
         //
-        // 00 00 00 len cmd args
+        // 00 00 len_hi len_lo cmd args
         //
         // Commands:
         // 02 -> capture rgb24
@@ -259,15 +155,28 @@ static void handle_stdin(struct capture_info *info)
         // 05 -> capture 1bbp, but scan down the columns
         // 06 <threshold> -> set the monochrome conversion threshold (no response)
         // 07 <dithering> -> set the dithering algorithm (no response)
+        // 08 <0|1> -> disable/enable the per-frame metadata header (no response)
+        // 09 -> capture rgb565 at half the width and height
+        // 0a -> capture at the quality level picked by the adaptive controller.
+        //       These frames always have the metadata header.
+        // 0b <fps (16-bit)> <bytes per second (32-bit)> -> set the adaptive
+        //       controller's targets. 0 means no limit. (no response)
+        // 0c -> capture 8-bit palette-indexed
+        // 0d -> capture 4-bit palette-indexed
+        // 0e <kind> <ordered dithering 0|1> [r g b]... -> set the palette
+        //       for indexed captures. Colors are only sent for user palettes. This
+        //       rebuilds the lookup tables, which can take tens of milliseconds. (no response)
 
         // NOTE: The request format is what it is since we're using Erlang's built-in 4-byte length
         //       framing for simplicity.
         if (info->request_buffer[0] != 0 ||
-                info->request_buffer[1] != 0 ||
-                info->request_buffer[2] != 0)
+                info->request_buffer[1] != 0)
             err(EXIT_FAILURE, "Unexpected command: %02x %02x %02x %02x", info->request_buffer[0], info->request_buffer[1], info->request_buffer[2], info->request_buffer[3]);
 
-        uint8_t len = 4 + info->request_buffer[3];
+        int len = 4 + ((info->request_buffer[2] << 8) | info->request_buffer[3]);
+        if (len >= MAX_REQUEST_BUFFER_SIZE)
+            errx(EXIT_FAILURE, "Command too long: %d bytes", len);
+
         if (info->request_buffer_ix < len)
             break;
 
@@ -277,15 +186,33 @@ static void handle_stdin(struct capture_info *info)
         case 3:
         case 4:
         case 5:
+        case 9:
+        case 10:
+        case 12:
+        case 13:
             info->send_snapshot = info->request_buffer[4];
+            info->request_ns = monotonic_ns();
             break;
 
         case 6:
-            set_mono_threshold(info, info->request_buffer[5]);
+            frame_set_mono_threshold(info, info->request_buffer[5]);
             break;
 
         case 7:
-            set_dithering(info, info->request_buffer[5]);
+            frame_set_dithering(info, info->request_buffer[5]);
+            break;
+
+        case 8:
+            set_frame_metadata(info, info->request_buffer[5]);
+            break;
+
+        case 11:
+            set_adaptive_target(info, &info->request_buffer[5]);
+            break;
+
+        case 14:
+            palette_set(&info->palette, info->request_buffer[5], info->request_buffer[6],
+                        &info->request_buffer[7], (len - 7) / 3);
             break;
 
         default: // ignore
@@ -300,19 +227,37 @@ static void handle_stdin(struct capture_info *info)
 
 static int send_snapshot(struct capture_info *info)
 {
-    switch (info->send_snapshot) {
-    case 1:
-    case 2:
-        return emit_rgb24(info);
-    case 3:
-        return emit_rgb565(info);
-    case 4:
-        return emit_mono(info);
-    case 5:
-        return emit_mono_rotate_flip(info);
-    default:
-        return 0;
+    int format = info->send_snapshot;
+    int with_header = info->frame_metadata;
+    int quality = 0;
+    int dithering = info->dithering;
+
+    // Adaptive frames always have the header since that's how Erlang finds
+    // out what was picked.
+    if (format == FORMAT_ADAPTIVE) {
+        size_t drain_len;
+        uint64_t drain_ns;
+        if (output_take_drain_sample(&info->output, &drain_len, &drain_ns))
+            adaptive_record_drain(&info->adaptive, drain_len, drain_ns);
+
+        quality = adaptive_choose(&info->adaptive, info, info->request_ns);
+        format = adaptive_format(quality);
+        info->dithering = adaptive_dithering(quality);
+        with_header = 1;
     }
+
+    size_t size = frame_size(info, format);
+    if (size > 0) {
+        uint8_t *out = start_frame(info, size, with_header);
+        out = frame_convert(info, format, out);
+        finish_frame(info, format, quality, with_header, out);
+    }
+
+    if (info->send_snapshot == FORMAT_ADAPTIVE) {
+        adaptive_record(&info->adaptive, quality, info->capture_ns + monotonic_ns() - info->convert_start);
+        info->dithering = dithering;
+    }
+    return 0;
 }
 
 int main(int argc, char *argv[])
@@ -331,21 +276,43 @@ int main(int argc, char *argv[])
     emit_capture_info(&info);
 
     for (;;) {
-        struct pollfd fdset[1];
+        struct pollfd fdset[2];
 
         fdset[0].fd = STDIN_FILENO;
         fdset[0].events = POLLIN;
         fdset[0].revents = 0;
 
-        int rc = poll(fdset, 1, -1);
+        // Only wait on stdout when there's something to send so that
+        // commands keep getting processed while Erlang is slow to read.
+        fdset[1].fd = STDOUT_FILENO;
+        fdset[1].events = output_pending(&info.output) ? POLLOUT : 0;
+        fdset[1].revents = 0;
+
+        int rc = poll(fdset, 2, -1);
         if (rc < 0)
             err(EXIT_FAILURE, "poll");
 
+        if (fdset[1].revents & POLLOUT)
+            output_flush(&info.output);
+
+        // Erlang closed its end. These get reported even when POLLOUT isn't
+        // requested, so exit rather than spin.
+        if (fdset[1].revents & (POLLERR | POLLHUP)) {
+            finalize(&info);
+            exit(EXIT_SUCCESS);
+        }
+
         if (fdset[0].revents & (POLLIN | POLLHUP))
             handle_stdin(&info);
 
-        if (info.send_snapshot) {
+        // Hold off on capturing when the output queue is full. The capture
+        // gets done when Erlang catches up so the frame is as fresh as possible.
+        if (info.send_snapshot && output_has_room(&info.output)) {
+            uint64_t capture_start = monotonic_ns();
             capture(&info);
+            info.capture_timestamp = monotonic_ns();
+            info.capture_ns = info.capture_timestamp - capture_start;
+            info.sequence++;
 
             send_snapshot(&info);
             info.send_snapshot = 0;
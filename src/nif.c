@@ -0,0 +1,243 @@
+#include <erl_nif.h>
+#include <string.h>
+
+#include "capture.h"
+#include "frame.h"
+
+// NIF version of the capture process. Captures and conversions are run on a
+// dirty scheduler and written straight into the binary that's returned to
+// Erlang so that frames aren't copied through a pipe.
+
+struct capture_resource {
+    ErlNifMutex *lock;
+    struct capture_info info;
+    int initialized;
+};
+
+static ErlNifResourceType *capture_resource_type;
+
+static ERL_NIF_TERM atom_ok;
+static ERL_NIF_TERM atom_error;
+
+static void capture_resource_dtor(ErlNifEnv *env, void *obj)
+{
+    struct capture_resource *resource = (struct capture_resource *) obj;
+
+    if (resource->initialized)
+        frame_finalize(&resource->info);
+    if (resource->lock)
+        enif_mutex_destroy(resource->lock);
+}
+
+static int load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
+{
+    atom_ok = enif_make_atom(env, "ok");
+    atom_error = enif_make_atom(env, "error");
+
+    capture_resource_type = enif_open_resource_type(env, NULL, "capture_resource",
+                            capture_resource_dtor, ERL_NIF_RT_CREATE, NULL);
+    return capture_resource_type ? 0 : -1;
+}
+
+static ERL_NIF_TERM make_error(ErlNifEnv *env, const char *reason)
+{
+    return enif_make_tuple2(env, atom_error, enif_make_atom(env, reason));
+}
+
+static int get_resource(ErlNifEnv *env, ERL_NIF_TERM term, struct capture_resource **resource)
+{
+    return enif_get_resource(env, term, capture_resource_type, (void **) resource);
+}
+
+// Lock the resource if it hasn't been closed. Returns 0 if it has.
+static int lock_open_resource(struct capture_resource *resource)
+{
+    enif_mutex_lock(resource->lock);
+    if (!resource->initialized) {
+        enif_mutex_unlock(resource->lock);
+        return 0;
+    }
+    return 1;
+}
+
+static ERL_NIF_TERM open_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    unsigned int display;
+    int width;
+    int height;
+
+    if (!enif_get_uint(env, argv[0], &display) ||
+            !enif_get_int(env, argv[1], &width) ||
+            !enif_get_int(env, argv[2], &height))
+        return enif_make_badarg(env);
+
+    struct capture_resource *resource =
+        enif_alloc_resource(capture_resource_type, sizeof(struct capture_resource));
+    resource->lock = enif_mutex_create("rpi_fb_capture");
+    resource->initialized = 0;
+    if (!resource->lock) {
+        enif_release_resource(resource);
+        return make_error(env, "enomem");
+    }
+
+    if (frame_initialize(display, width, height, &resource->info) < 0) {
+        enif_release_resource(resource);
+        return make_error(env, "init_failed");
+    }
+    resource->initialized = 1;
+
+    ERL_NIF_TERM term = enif_make_resource(env, resource);
+    enif_release_resource(resource);
+
+    return enif_make_tuple2(env, atom_ok, term);
+}
+
+static ERL_NIF_TERM close_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    struct capture_resource *resource;
+    if (!get_resource(env, argv[0], &resource))
+        return enif_make_badarg(env);
+
+    // Release the display now rather than waiting for the garbage collector so
+    // that it can be reopened right away.
+    if (lock_open_resource(resource)) {
+        frame_finalize(&resource->info);
+        resource->initialized = 0;
+        enif_mutex_unlock(resource->lock);
+    }
+
+    return atom_ok;
+}
+
+static ERL_NIF_TERM info_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    struct capture_resource *resource;
+    if (!get_resource(env, argv[0], &resource) ||
+            !lock_open_resource(resource))
+        return enif_make_badarg(env);
+
+    const struct capture_info *info = &resource->info;
+    ERL_NIF_TERM backend_name;
+    size_t backend_name_len = strnlen(info->backend_name, sizeof(info->backend_name));
+    memcpy(enif_make_new_binary(env, backend_name_len, &backend_name), info->backend_name, backend_name_len);
+
+    ERL_NIF_TERM fields[6] = {
+        backend_name,
+        enif_make_int(env, info->display_id),
+        enif_make_int(env, info->display_width),
+        enif_make_int(env, info->display_height),
+        enif_make_int(env, info->capture_width),
+        enif_make_int(env, info->capture_height)
+    };
+
+    enif_mutex_unlock(resource->lock);
+
+    return enif_make_tuple_from_array(env, fields, 6);
+}
+
+static ERL_NIF_TERM capture_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    struct capture_resource *resource;
+    int format;
+    if (!get_resource(env, argv[0], &resource) ||
+            !enif_get_int(env, argv[1], &format) ||
+            !lock_open_resource(resource))
+        return enif_make_badarg(env);
+
+    struct capture_info *info = &resource->info;
+
+    size_t size = frame_size(info, format);
+    if (size == 0) {
+        enif_mutex_unlock(resource->lock);
+        return make_error(env, "unsupported_format");
+    }
+
+    ErlNifBinary data;
+    if (!enif_alloc_binary(size, &data)) {
+        enif_mutex_unlock(resource->lock);
+        return make_error(env, "enomem");
+    }
+
+    capture(info);
+    uint64_t capture_timestamp = monotonic_ns();
+    info->sequence++;
+
+    frame_convert(info, format, data.data);
+    uint64_t convert_ns = monotonic_ns() - capture_timestamp - info->dither_ns;
+
+    ERL_NIF_TERM fields[6] = {
+        atom_ok,
+        enif_make_binary(env, &data),
+        enif_make_uint(env, info->sequence),
+        enif_make_uint64(env, capture_timestamp),
+        enif_make_uint64(env, convert_ns),
+        enif_make_uint(env, info->dither_ns)
+    };
+
+    enif_mutex_unlock(resource->lock);
+
+    return enif_make_tuple_from_array(env, fields, 6);
+}
+
+static ERL_NIF_TERM set_mono_threshold_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    struct capture_resource *resource;
+    unsigned int threshold;
+    if (!get_resource(env, argv[0], &resource) ||
+            !enif_get_uint(env, argv[1], &threshold) ||
+            threshold > 255 ||
+            !lock_open_resource(resource))
+        return enif_make_badarg(env);
+
+    frame_set_mono_threshold(&resource->info, threshold);
+    enif_mutex_unlock(resource->lock);
+
+    return atom_ok;
+}
+
+static ERL_NIF_TERM set_dithering_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    struct capture_resource *resource;
+    unsigned int dithering;
+    if (!get_resource(env, argv[0], &resource) ||
+            !enif_get_uint(env, argv[1], &dithering) ||
+            dithering > 255 ||
+            !lock_open_resource(resource))
+        return enif_make_badarg(env);
+
+    frame_set_dithering(&resource->info, dithering);
+    enif_mutex_unlock(resource->lock);
+
+    return atom_ok;
+}
+
+static ERL_NIF_TERM set_palette_nif(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    struct capture_resource *resource;
+    int kind;
+    int ordered_dithering;
+    ErlNifBinary colors;
+    if (!get_resource(env, argv[0], &resource) ||
+            !enif_get_int(env, argv[1], &kind) ||
+            !enif_get_int(env, argv[2], &ordered_dithering) ||
+            !enif_inspect_binary(env, argv[3], &colors) ||
+            !lock_open_resource(resource))
+        return enif_make_badarg(env);
+
+    palette_set(&resource->info.palette, kind, ordered_dithering, colors.data, colors.size / 3);
+    enif_mutex_unlock(resource->lock);
+
+    return atom_ok;
+}
+
+static ErlNifFunc nif_funcs[] = {
+    {"open", 3, open_nif, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"info", 1, info_nif, 0},
+    {"capture", 2, capture_nif, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"set_mono_threshold", 2, set_mono_threshold_nif, 0},
+    {"set_dithering", 2, set_dithering_nif, 0},
+    {"set_palette", 4, set_palette_nif, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"close", 1, close_nif, 0}
+};
+
+ERL_NIF_INIT(Elixir.RpiFbCapture.Nif, nif_funcs, load, NULL, NULL, NULL)
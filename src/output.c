@@ -0,0 +1,114 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "output.h"
+
+// The output queue keeps stdout non-blocking so that a slow reader on the
+// Erlang side can't stop us from processing commands. Packets are written
+// out as the pipe drains. Each queue slot owns a buffer that's the same size
+// as the caller's work buffer so enqueuing is a pointer swap rather than a
+// copy.
+
+int output_initialize(struct output_queue *queue, int fd, size_t buffer_size)
+{
+    queue->fd = fd;
+    queue->head = 0;
+    queue->count = 0;
+    queue->drain_sample_ready = 0;
+
+    for (int i = 0; i < OUTPUT_QUEUE_DEPTH; i++) {
+        queue->packets[i].data = (uint8_t *) malloc(buffer_size);
+        if (!queue->packets[i].data)
+            return -1;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+
+    return 0;
+}
+
+void output_finalize(struct output_queue *queue)
+{
+    for (int i = 0; i < OUTPUT_QUEUE_DEPTH; i++)
+        free(queue->packets[i].data);
+}
+
+static struct output_packet *packet_at(struct output_queue *queue, int i)
+{
+    return &queue->packets[(queue->head + i) % OUTPUT_QUEUE_DEPTH];
+}
+
+int output_has_room(const struct output_queue *queue)
+{
+    return queue->count < OUTPUT_QUEUE_DEPTH;
+}
+
+// Callers check output_has_room() first. Waiting for room here would stop
+// commands from being processed, so a full queue is an error.
+int output_enqueue(struct output_queue *queue, uint8_t **buffer, size_t len)
+{
+    if (!output_has_room(queue))
+        return -1;
+
+    struct output_packet *packet = packet_at(queue, queue->count);
+    queue->count++;
+
+    // Trade buffers so that the caller can start on the next packet right away
+    uint8_t *data = packet->data;
+    packet->data = *buffer;
+    packet->len = len;
+    packet->offset = 0;
+    packet->start_ns = monotonic_ns();
+    packet->blocked = 0;
+    *buffer = data;
+
+    output_flush(queue);
+    return 0;
+}
+
+void output_flush(struct output_queue *queue)
+{
+    while (queue->count > 0) {
+        struct output_packet *packet = packet_at(queue, 0);
+
+        ssize_t amount_written = write(queue->fd, packet->data + packet->offset, packet->len - packet->offset);
+        if (amount_written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                packet->blocked = 1;
+                return;
+            }
+            if (errno == EINTR)
+                continue;
+            err(EXIT_FAILURE, "write");
+        }
+
+        packet->offset += amount_written;
+        if (packet->offset == packet->len) {
+            queue->drain_sample_ready = 1;
+            queue->drain_sample_len = packet->len;
+            queue->drain_sample_ns = packet->blocked ? monotonic_ns() - packet->start_ns : 0;
+
+            queue->head = (queue->head + 1) % OUTPUT_QUEUE_DEPTH;
+            queue->count--;
+        }
+    }
+}
+
+// Get how long the last finished packet took to drain. Returns 0 if no
+// packet has finished since the last call.
+int output_take_drain_sample(struct output_queue *queue, size_t *len, uint64_t *drain_ns)
+{
+    if (!queue->drain_sample_ready)
+        return 0;
+
+    *len = queue->drain_sample_len;
+    *drain_ns = queue->drain_sample_ns;
+    queue->drain_sample_ready = 0;
+    return 1;
+}
@@ -0,0 +1,47 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of packets that can be waiting to be written to Erlang. Erlang only
+// asks for one frame at a time, so this covers a frame and the capture info.
+#define OUTPUT_QUEUE_DEPTH          2
+
+struct output_packet {
+    uint8_t *data;
+    size_t len;
+    size_t offset;
+
+    // When the packet was queued and whether a write to it hit EAGAIN
+    uint64_t start_ns;
+    int blocked;
+};
+
+struct output_queue {
+    int fd;
+
+    struct output_packet packets[OUTPUT_QUEUE_DEPTH];
+    int head;
+    int count;
+
+    // The last packet that finished. drain_ns is 0 if it went straight into
+    // the pipe without backing up.
+    int drain_sample_ready;
+    size_t drain_sample_len;
+    uint64_t drain_sample_ns;
+};
+
+int output_initialize(struct output_queue *queue, int fd, size_t buffer_size);
+void output_finalize(struct output_queue *queue);
+int output_has_room(const struct output_queue *queue);
+int output_enqueue(struct output_queue *queue, uint8_t **buffer, size_t len);
+void output_flush(struct output_queue *queue);
+int output_take_drain_sample(struct output_queue *queue, size_t *len, uint64_t *drain_ns);
+
+static inline int output_pending(const struct output_queue *queue)
+{
+    return queue->count > 0;
+}
+
+#endif
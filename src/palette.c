@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "palette.h"
+
+// Palette-indexed conversions. Fixed palettes map rgb565 pixels through a
+// 64K entry lookup table that's built when the palette is set so that
+// captures never stall on it. Adaptive palettes are built
+// each frame by binning pixels to rgb444 and picking the most popular bins
+// (the popularity algorithm). Ordered dithering, if enabled, nudges each
+// pixel with a 4x4 Bayer matrix before the lookup.
+
+#define HISTOGRAM_BINS              4096
+
+// Default 4-bit palette (the 16 VGA colors)
+static const uint8_t vga_colors[16 * 3] = {
+    0, 0, 0,        0, 0, 170,      0, 170, 0,      0, 170, 170,
+    170, 0, 0,      170, 0, 170,    170, 85, 0,     170, 170, 170,
+    85, 85, 85,     85, 85, 255,    85, 255, 85,    85, 255, 255,
+    255, 85, 85,    255, 85, 255,   255, 255, 85,   255, 255, 255
+};
+
+// Default 8-bit palette (the 216 web-safe colors). Filled in on init.
+static uint8_t web_safe_colors[216 * 3];
+
+static const uint8_t bayer4x4[4][4] = {
+    { 0,  8,  2, 10},
+    {12,  4, 14,  6},
+    { 3, 11,  1,  9},
+    {15,  7, 13,  5}
+};
+
+static void build_lookup565(struct palette_info *palette, int bits);
+
+// The web-safe colors are a 6x6x6 cube, so the nearest one can be found
+// per channel. This is the same as searching, but quick enough for init.
+static void build_web_safe_lookup565(uint8_t *lookup)
+{
+    for (int i = 0; i < 65536; i++) {
+        int r = ((i >> 11) << 3) + 25;
+        int g = (((i >> 5) & 0x3f) << 2) + 25;
+        int b = ((i & 0x1f) << 3) + 25;
+        lookup[i] = (r / 51) * 36 + (g / 51) * 6 + b / 51;
+    }
+}
+
+int palette_initialize(struct palette_info *palette)
+{
+    uint8_t *color = web_safe_colors;
+    for (int r = 0; r < 6; r++) {
+        for (int g = 0; g < 6; g++) {
+            for (int b = 0; b < 6; b++) {
+                color[0] = r * 51;
+                color[1] = g * 51;
+                color[2] = b * 51;
+                color += 3;
+            }
+        }
+    }
+
+    palette->kind = PALETTE_FIXED;
+    palette->ordered_dithering = 0;
+    palette->user_count = 0;
+    palette->lookup565[0] = (uint8_t *) malloc(65536);
+    palette->lookup565[1] = (uint8_t *) malloc(65536);
+
+    // Count and red, green, and blue sums for each bin
+    palette->histogram = (uint32_t *) malloc(HISTOGRAM_BINS * 4 * sizeof(uint32_t));
+
+    if (!palette->lookup565[0] || !palette->lookup565[1] || !palette->histogram)
+        return -1;
+
+    build_web_safe_lookup565(palette->lookup565[0]);
+    build_lookup565(palette, 4);
+
+    return 0;
+}
+
+void palette_finalize(struct palette_info *palette)
+{
+    free(palette->lookup565[0]);
+    free(palette->lookup565[1]);
+    free(palette->histogram);
+}
+
+void palette_set(struct palette_info *palette, int kind, int ordered_dithering, const uint8_t *colors, int count)
+{
+    if (count > PALETTE_MAX_COLORS)
+        count = PALETTE_MAX_COLORS;
+
+    // A user palette without any colors isn't useful, so use the default one.
+    if (kind == PALETTE_USER && count == 0)
+        kind = PALETTE_FIXED;
+
+    palette->kind = kind;
+    palette->ordered_dithering = ordered_dithering;
+
+    if (kind == PALETTE_USER) {
+        memcpy(palette->user_colors, colors, count * 3);
+        palette->user_count = count;
+    }
+
+    // Adaptive palettes don't use the lookups. A user palette takes a
+    // nearest color search for each rgb565 value, so this can take tens of
+    // milliseconds for large palettes.
+    if (kind == PALETTE_USER) {
+        build_lookup565(palette, 8);
+        build_lookup565(palette, 4);
+    } else if (kind == PALETTE_FIXED) {
+        build_web_safe_lookup565(palette->lookup565[0]);
+        build_lookup565(palette, 4);
+    }
+}
+
+static inline int max_colors(int bits)
+{
+    return bits == 8 ? 256 : 16;
+}
+
+static int fixed_colors(const struct palette_info *palette, int bits, const uint8_t **colors)
+{
+    if (palette->kind == PALETTE_USER) {
+        *colors = palette->user_colors;
+        return palette->user_count < max_colors(bits) ? palette->user_count : max_colors(bits);
+    } else if (bits == 8) {
+        *colors = web_safe_colors;
+        return 216;
+    } else {
+        *colors = vga_colors;
+        return 16;
+    }
+}
+
+static uint8_t nearest_color(const uint8_t *colors, int count, int r, int g, int b)
+{
+    int best = 0;
+    int best_distance = 3 * 256 * 256;
+
+    for (int i = 0; i < count; i++) {
+        int dr = colors[0] - r;
+        int dg = colors[1] - g;
+        int db = colors[2] - b;
+        int distance = dr * dr + dg * dg + db * db;
+        if (distance < best_distance) {
+            best = i;
+            best_distance = distance;
+        }
+        colors += 3;
+    }
+    return best;
+}
+
+static inline int bin444(uint16_t rgb565)
+{
+    return ((rgb565 >> 12) << 8) | (((rgb565 >> 7) & 0xf) << 4) | ((rgb565 >> 1) & 0xf);
+}
+
+static void build_lookup565(struct palette_info *palette, int bits)
+{
+    const uint8_t *colors;
+    int count = fixed_colors(palette, bits, &colors);
+    uint8_t *lookup = palette->lookup565[bits == 8 ? 0 : 1];
+
+    for (int i = 0; i < 65536; i++)
+        lookup[i] = nearest_color(colors, count, (i >> 11) << 3, ((i >> 5) & 0x3f) << 2, (i & 0x1f) << 3);
+}
+
+static int build_adaptive(struct capture_info *info, int bits, uint8_t *colors)
+{
+    struct palette_info *palette = &info->palette;
+    uint32_t *histogram = palette->histogram;
+    const uint16_t *image = info->buffer;
+
+    memset(histogram, 0, HISTOGRAM_BINS * 4 * sizeof(uint32_t));
+    for (int y = 0; y < info->capture_height; y++) {
+        for (int x = 0; x < info->capture_width; x++) {
+            uint16_t pixel = image[x];
+            uint32_t *bin = &histogram[bin444(pixel) * 4];
+            bin[0]++;
+            bin[1] += (pixel >> 11) << 3;
+            bin[2] += ((pixel >> 5) & 0x3f) << 2;
+            bin[3] += (pixel & 0x1f) << 3;
+        }
+        image += info->capture_stride;
+    }
+
+    // Pick the most popular bins. Each one's color is the average of its pixels.
+    int count = 0;
+    while (count < max_colors(bits)) {
+        uint32_t *best = NULL;
+        for (int i = 0; i < HISTOGRAM_BINS; i++) {
+            uint32_t *bin = &histogram[i * 4];
+            if (bin[0] > 0 && (!best || bin[0] > best[0]))
+                best = bin;
+        }
+        if (!best)
+            break;
+
+        colors[count * 3] = best[1] / best[0];
+        colors[count * 3 + 1] = best[2] / best[0];
+        colors[count * 3 + 2] = best[3] / best[0];
+        best[0] = 0;
+        count++;
+    }
+
+    for (int i = 0; i < HISTOGRAM_BINS; i++)
+        palette->lookup444[i] = nearest_color(colors, count, ((i >> 8) << 4) | 8, (((i >> 4) & 0xf) << 4) | 8, ((i & 0xf) << 4) | 8);
+
+    return count;
+}
+
+static inline int clamp8(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static inline uint16_t ordered_dither(uint16_t rgb565, int x, int y, int spread)
+{
+    int offset = (2 * bayer4x4[y & 3][x & 3] - 15) * spread / 32;
+    int r = clamp8(((rgb565 >> 11) << 3) + offset);
+    int g = clamp8((((rgb565 >> 5) & 0x3f) << 2) + offset);
+    int b = clamp8(((rgb565 & 0x1f) << 3) + offset);
+
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+uint8_t *palette_convert(struct capture_info *info, int bits, uint8_t *out)
+{
+    struct palette_info *palette = &info->palette;
+    int width = info->capture_width;
+    int height = info->capture_height;
+    const uint16_t *image = info->buffer;
+
+    // Every frame starts with a full size palette. Unused entries are black.
+    int palette_len = max_colors(bits) * 3;
+    const uint8_t *lookup565 = NULL;
+    memset(out, 0, palette_len);
+    if (palette->kind == PALETTE_ADAPTIVE) {
+        build_adaptive(info, bits, out);
+    } else {
+        const uint8_t *colors;
+        int count = fixed_colors(palette, bits, &colors);
+        memcpy(out, colors, count * 3);
+        lookup565 = palette->lookup565[bits == 8 ? 0 : 1];
+    }
+    out += palette_len;
+
+    // Roughly the distance between palette colors on each channel
+    int spread = bits == 8 ? 51 : 85;
+    size_t n = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint16_t pixel = image[x];
+            if (palette->ordered_dithering)
+                pixel = ordered_dither(pixel, x, y, spread);
+
+            uint8_t index = lookup565 ? lookup565[pixel] : palette->lookup444[bin444(pixel)];
+            if (bits == 8) {
+                *out++ = index;
+            } else if (n & 1) {
+                *out++ |= index << 4;
+            } else {
+                *out = index;
+            }
+            n++;
+        }
+        image += info->capture_stride;
+    }
+
+    // Finish the last byte if there were an odd number of 4-bit pixels
+    if (bits == 4 && (n & 1))
+        out++;
+
+    return out;
+}
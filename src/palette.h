@@ -0,0 +1,36 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <stdint.h>
+
+// Palette kinds
+#define PALETTE_FIXED               0
+#define PALETTE_USER                1
+#define PALETTE_ADAPTIVE            2
+
+#define PALETTE_MAX_COLORS          256
+
+struct capture_info;
+
+struct palette_info {
+    int kind;
+    int ordered_dithering;
+
+    int user_count;
+    uint8_t user_colors[PALETTE_MAX_COLORS * 3];
+
+    // rgb565 -> index lookups for the fixed or user palettes. One for 8-bit
+    // and one for 4-bit indices. They're rebuilt whenever the palette is set.
+    uint8_t *lookup565[2];
+
+    // Adaptive palette scratch space. Colors are binned to rgb444.
+    uint32_t *histogram;
+    uint8_t lookup444[4096];
+};
+
+int palette_initialize(struct palette_info *palette);
+void palette_finalize(struct palette_info *palette);
+void palette_set(struct palette_info *palette, int kind, int ordered_dithering, const uint8_t *colors, int count);
+uint8_t *palette_convert(struct capture_info *info, int bits, uint8_t *out);
+
+#endif
@@ -4,8 +4,9 @@ defmodule RpiFbCaptureTest do
   @width 64
   @height 48
 
-  setup do
-    pid = start_supervised!({RpiFbCapture, [width: @width, height: @height]})
+  setup context do
+    options = Keyword.merge([width: @width, height: @height], Map.get(context, :options, []))
+    pid = start_supervised!({RpiFbCapture, options})
 
     # Workaround: wait for port to start
     Process.sleep(50)
@@ -31,6 +32,10 @@ defmodule RpiFbCaptureTest do
     generates_expected(server, :rgb565)
   end
 
+  test "generates expected rgb565_half", %{server: server} do
+    generates_expected(server, :rgb565_half)
+  end
+
   describe "generates expected mono" do
     test "without dithering", %{server: server} do
       generates_expected(server, :mono)
@@ -75,20 +80,248 @@ defmodule RpiFbCaptureTest do
     end
   end
 
+  @tag options: [width: 0, height: 0]
+  test "sends full size frames intact", %{server: server} do
+    # The simulated display is 1280x720, so frames take many writes to send
+    {:ok, frame} = RpiFbCapture.capture(server, :rgb24)
+
+    assert {frame.width, frame.height} == {1280, 720}
+    assert byte_size(IO.iodata_to_binary(frame.data)) == 1280 * 720 * 3
+
+    {:ok, frame} = RpiFbCapture.capture(server, :rgb565)
+    assert byte_size(IO.iodata_to_binary(frame.data)) == 1280 * 720 * 2
+  end
+
+  @tag options: [metadata: true]
+  test "reports frame metadata", %{server: server} do
+    {:ok, first} = RpiFbCapture.capture(server, :rgb565)
+    {:ok, second} = RpiFbCapture.capture(server, :rgb565)
+
+    assert second.sequence == first.sequence + 1
+    assert second.timestamp > first.timestamp
+    assert is_integer(first.convert_time)
+    assert first.dither_time == 0
+    assert first.roi == {0, 0, @width, @height}
+    assert first.width == @width
+    assert first.height == @height
+
+    expected_data = File.read!(expected_path(@width, @height, :rgb565, :none))
+    assert IO.iodata_to_binary(first.data) == expected_data
+  end
+
+  describe "generates expected indexed" do
+    test "8-bit with the fixed palette", %{server: server} do
+      generates_expected(server, :indexed8)
+    end
+
+    test "4-bit with the fixed palette", %{server: server} do
+      generates_expected(server, :indexed4)
+    end
+
+    test "8-bit with an adaptive palette", %{server: server} do
+      :ok = RpiFbCapture.set_palette(server, :adaptive)
+      generates_expected_indexed(server, :indexed8, :adaptive)
+    end
+
+    test "4-bit with an adaptive palette", %{server: server} do
+      :ok = RpiFbCapture.set_palette(server, :adaptive)
+      generates_expected_indexed(server, :indexed4, :adaptive)
+    end
+
+    test "4-bit with a user palette and ordered dithering", %{server: server} do
+      colors = [{0, 0, 0}, {255, 255, 255}, {255, 0, 0}]
+      :ok = RpiFbCapture.set_palette(server, colors, dithering: :ordered)
+      frame = generates_expected_indexed(server, :indexed4, :user_ordered)
+
+      assert binary_part(frame.palette, 0, 9) == <<0, 0, 0, 255, 255, 255, 255, 0, 0>>
+    end
+
+    test "8-bit with a full user palette", %{server: server} do
+      colors = for i <- 0..255, do: {i, i, i}
+      :ok = RpiFbCapture.set_palette(server, colors)
+      {:ok, frame} = RpiFbCapture.capture(server, :indexed8)
+
+      assert frame.palette == IO.iodata_to_binary(for i <- 0..255, do: [i, i, i])
+    end
+
+    test "rejects invalid palettes", %{server: server} do
+      too_many = for i <- 0..256, do: {rem(i, 256), 0, 0}
+
+      assert RpiFbCapture.set_palette(server, too_many) == {:error, :invalid_palette}
+      assert RpiFbCapture.set_palette(server, []) == {:error, :invalid_palette}
+      assert RpiFbCapture.set_palette(server, [{256, 0, 0}]) == {:error, :invalid_palette}
+      assert RpiFbCapture.set_palette(server, [{0, 0}]) == {:error, :invalid_palette}
+      assert RpiFbCapture.set_palette(server, :fancy) == {:error, :invalid_palette}
+
+      assert RpiFbCapture.set_palette(server, :fixed, dithering: :sierra) ==
+               {:error, :invalid_palette}
+
+      # The capture process is still running
+      assert {:ok, _frame} = RpiFbCapture.capture(server, :indexed8)
+    end
+  end
+
+  describe "adaptive captures" do
+    test "use full quality without targets", %{server: server} do
+      {:ok, frame} = RpiFbCapture.capture(server, :adaptive)
+
+      assert frame.format == :rgb565
+      assert frame.quality == 0
+      assert {frame.width, frame.height} == {@width, @height}
+    end
+
+    test "step down to meet the bandwidth target", %{server: server} do
+      # rgb565 and rgb565_half are both over 20,000 bytes/second at 30 fps
+      :ok = RpiFbCapture.set_adaptive_target(server, fps: 30, bytes_per_second: 20_000)
+      {:ok, frame} = RpiFbCapture.capture(server, :adaptive)
+
+      assert frame.format == :mono
+      assert frame.quality == 2
+
+      expected_data = File.read!(expected_path(@width, @height, :mono, :sierra))
+      assert IO.iodata_to_binary(frame.data) == expected_data
+    end
+
+    test "report half size frames", %{server: server} do
+      :ok = RpiFbCapture.set_adaptive_target(server, fps: 30, bytes_per_second: 60_000)
+      {:ok, frame} = RpiFbCapture.capture(server, :adaptive)
+
+      assert frame.format == :rgb565_half
+      assert frame.quality == 1
+      assert {frame.width, frame.height} == {div(@width, 2), div(@height, 2)}
+      assert frame.roi == {0, 0, @width, @height}
+    end
+
+    test "stay at full quality when paced at the target", %{server: server} do
+      :ok = RpiFbCapture.set_adaptive_target(server, fps: 30)
+
+      qualities =
+        for _ <- 1..20 do
+          {:ok, frame} = RpiFbCapture.capture(server, :adaptive)
+          Process.sleep(33)
+          frame.quality
+        end
+
+      assert Enum.all?(qualities, &(&1 == 0))
+    end
+
+    test "accept frame rates over 255", %{server: server} do
+      :ok = RpiFbCapture.set_adaptive_target(server, fps: 1000)
+      {:ok, frame} = RpiFbCapture.capture(server, :adaptive)
+
+      assert frame.format in [:rgb565, :rgb565_half, :mono]
+    end
+
+    test "reject invalid targets", %{server: server} do
+      assert RpiFbCapture.set_adaptive_target(server, fps: 65_536) == {:error, :invalid_target}
+      assert RpiFbCapture.set_adaptive_target(server, fps: 29.97) == {:error, :invalid_target}
+
+      assert RpiFbCapture.set_adaptive_target(server, bytes_per_second: -1) ==
+               {:error, :invalid_target}
+
+      assert RpiFbCapture.set_adaptive_target(server, bytes_per_second: 0x1_0000_0000) ==
+               {:error, :invalid_target}
+    end
+  end
+
+  test "rejects out of range mono thresholds", %{server: server} do
+    assert RpiFbCapture.set_mono_threshold(server, 256) == {:error, :invalid_threshold}
+    assert RpiFbCapture.set_mono_threshold(server, -1) == {:error, :invalid_threshold}
+    assert RpiFbCapture.set_mono_threshold(server, 12.5) == {:error, :invalid_threshold}
+    assert RpiFbCapture.set_mono_threshold(server, 255) == :ok
+  end
+
+  test "no frame metadata by default", %{server: server} do
+    {:ok, frame} = RpiFbCapture.capture(server, :rgb565)
+
+    assert frame.sequence == nil
+    assert frame.roi == nil
+  end
+
+  describe "nif transport" do
+    @describetag options: [transport: :nif]
+
+    test "running simulator", %{server: server} do
+      assert RpiFbCapture.backend(server) == "sim"
+    end
+
+    test "generates expected ppm", %{server: server} do
+      generates_expected(server, :ppm)
+    end
+
+    test "generates expected rgb565", %{server: server} do
+      generates_expected(server, :rgb565)
+    end
+
+    test "generates expected rgb565_half", %{server: server} do
+      generates_expected(server, :rgb565_half)
+    end
+
+    test "generates expected indexed8 with an adaptive palette", %{server: server} do
+      :ok = RpiFbCapture.set_palette(server, :adaptive)
+      generates_expected_indexed(server, :indexed8, :adaptive)
+    end
+
+    test "generates expected mono with sierra", %{server: server} do
+      generates_expected(server, :mono, :sierra)
+    end
+
+    test "generates expected mono_column_scan", %{server: server} do
+      generates_expected(server, :mono_column_scan)
+    end
+
+    test "rejects out of range mono thresholds", %{server: server} do
+      assert RpiFbCapture.set_mono_threshold(server, 256) == {:error, :invalid_threshold}
+      assert RpiFbCapture.set_mono_threshold(server, 255) == :ok
+    end
+
+    test "can be reopened after being stopped" do
+      :ok = stop_supervised(RpiFbCapture)
+
+      pid = start_supervised!({RpiFbCapture, width: @width, height: @height, transport: :nif})
+      assert {:ok, _frame} = RpiFbCapture.capture(pid, :rgb565)
+    end
+
+    @tag options: [transport: :nif, metadata: true]
+    test "reports frame metadata", %{server: server} do
+      {:ok, first} = RpiFbCapture.capture(server, :rgb565)
+      {:ok, second} = RpiFbCapture.capture(server, :rgb565)
+
+      assert second.sequence == first.sequence + 1
+      assert second.timestamp > first.timestamp
+      assert first.roi == {0, 0, @width, @height}
+    end
+  end
+
   defp generates_expected(server, format, dither \\ :none) do
     :ok = RpiFbCapture.set_dithering(server, dither)
     {:ok, frame} = RpiFbCapture.capture(server, format)
 
     assert frame.format == format
-    assert frame.width == @width
-    assert frame.height == @height
+    assert {frame.width, frame.height} == expected_dimensions(format)
 
-    data = IO.iodata_to_binary(frame.data)
-    expected_data = File.read!(expected_path(frame.width, frame.height, frame.format, dither))
+    data = IO.iodata_to_binary([frame.palette || [], frame.data])
+    expected_data = File.read!(expected_path(@width, @height, frame.format, dither))
 
     assert data == expected_data
   end
 
+  # The expected files for indexed formats have the palette followed by the indices
+  defp generates_expected_indexed(server, format, variant) do
+    {:ok, frame} = RpiFbCapture.capture(server, format)
+
+    assert frame.format == format
+    assert {frame.width, frame.height} == {@width, @height}
+
+    data = IO.iodata_to_binary([frame.palette, frame.data])
+    assert data == File.read!(expected_path(@width, @height, format, variant))
+
+    frame
+  end
+
+  defp expected_dimensions(:rgb565_half), do: {div(@width, 2), div(@height, 2)}
+  defp expected_dimensions(_format), do: {@width, @height}
+
   defp expected_path(width, height, format, :none) do
     "test/support/mandelbrot-#{width}x#{height}.#{format}"
   end